@@ -29,6 +29,19 @@
 
 #include "project.h"
 
+#define TAPDEV_PREFIX "/dev/xen/blktap-2/tapdev"
+
+/* Minor of a tapdev path, -1 if path isn't one */
+static int tapdev_minor(const char *path)
+{
+  size_t len = strlen(TAPDEV_PREFIX);
+
+  if (strncmp(path, TAPDEV_PREFIX, len) || path[len] == '\0')
+    return -1;
+
+  return strtol(path + len, NULL, 10);
+}
+
 static int cdrom_vdev_of_domid(int domid)
 {
   char xpath[256], **devs, *type;
@@ -45,8 +58,10 @@ static int cdrom_vdev_of_domid(int domid)
       if (type != NULL && !strcmp(type, "cdrom")) {
 	/* CDROM found! */
 	res = vdev;
+	free(type);
 	break;
       }
+      free(type);
     }
     free(devs);
   }
@@ -54,17 +69,34 @@ static int cdrom_vdev_of_domid(int domid)
   return res;
 }
 
+/*
+ * params is usually the tapdev, but it's "" after an eject and the ISO
+ * path after an in-place change. The tapdev is still the one in
+ * physical-device ("major:minor", in hex) in those cases.
+ */
 static int cdrom_tap_minor_of_vdev(int domid, int vdev)
 {
-  char *tmp;
+  char *tmp, *colon;
   int tap_minor = -1;
 
   if (vdev < 0)
     return -1;
 
   tmp = xenstore_be_read(XBT_NULL, domid, vdev, "params");
-  if (tmp != NULL)
-    tap_minor = strtol(tmp + 24, NULL, 10);
+  if (tmp != NULL) {
+    tap_minor = tapdev_minor(tmp);
+    free(tmp);
+  }
+  if (tap_minor >= 0)
+    return tap_minor;
+
+  tmp = xenstore_be_read(XBT_NULL, domid, vdev, "physical-device");
+  if (tmp != NULL) {
+    colon = strchr(tmp, ':');
+    if (colon != NULL && colon[1] != '\0')
+      tap_minor = strtol(colon + 1, NULL, 16);
+    free(tmp);
+  }
 
   return tap_minor;
 }
@@ -77,13 +109,13 @@ static unsigned int cdrom_count_and_print(int tap_minor, int max, bool print)
   unsigned int res = 0;
 
   /* Find the CDROM virtual device for the given domid */
-  domids = xs_directory(xs_handle, XBT_NULL, "/local/domain/0/backend/vbd", &count);
+  domids = xs_directory(xs_handle, XBT_NULL, VBD_BACKEND_ROOT, &count);
   if (domids) {
     for (i = 0; i < count; ++i) {
       domid = strtol(domids[i], NULL, 10);
       tm = cdrom_tap_minor_of_vdev(domid, cdrom_vdev_of_domid(domid));
       if (print)
-	printf("CDROM for domid %d: %d\n", domid, tm);
+	log(LOG_INFO, "CDROM for domid %d: %d", domid, tm);
       if (tm == tap_minor)
 	res++;
       if (res >= max)
@@ -98,45 +130,63 @@ static unsigned int cdrom_count_and_print(int tap_minor, int max, bool print)
 static void recreate(int domid, int vdev, const char *params, const char *type, const char *physical, const char *tapdisk_params)
 {
   xs_transaction_t trans;
+  uint64_t start;
 
   /* Kill the current vdev */
   while (1) {
+    start = trace_begin();
     trans = xs_transaction_start(xs_handle);
 
     xenstore_be_write(trans, domid, vdev, "online", "0");
     xenstore_be_write(trans, domid, vdev, "state",  "5");
 
     if (xs_transaction_end(xs_handle, trans, false) == false) {
-      if (errno == EAGAIN)
+      if (errno == EAGAIN) {
+	trace_end(start, "xs_transaction_conflict", domid, "kill vdev");
+	log(LOG_DEBUG, "xenstore transaction \"kill vdev\" for domid %d vdev %d conflicted, retrying", domid, vdev);
 	continue;
+      }
+      trace_end(start, "xs_transaction_failed", domid, "kill vdev");
+      break;
     }
+    trace_end(start, "xs_transaction", domid, "kill vdev");
     break;
   }
 
   /* TODO: should be a watch for states to go to 6 */
+  start = trace_begin();
   while (1) {
     sleep(1);
     if (!strcmp(xenstore_be_read(XBT_NULL, domid, vdev, "state"), "6") &&
 	!strcmp(xenstore_fe_read(XBT_NULL, domid, vdev, "state"), "6"))
       break;
   }
+  trace_end(start, "wait_closed", domid, NULL);
 
   /* Remove all traces of the vdev */
   while (1) {
+    start = trace_begin();
     trans = xs_transaction_start(xs_handle);
 
     xenstore_be_destroy(trans, domid, vdev);
     xenstore_fe_destroy(trans, domid, vdev);
 
     if (xs_transaction_end(xs_handle, trans, false) == false) {
-      if (errno == EAGAIN)
+      if (errno == EAGAIN) {
+	trace_end(start, "xs_transaction_conflict", domid, "destroy vdev");
+	log(LOG_DEBUG, "xenstore transaction \"destroy vdev\" for domid %d vdev %d conflicted, retrying", domid, vdev);
 	continue;
+      }
+      trace_end(start, "xs_transaction_failed", domid, "destroy vdev");
+      break;
     }
+    trace_end(start, "xs_transaction", domid, "destroy vdev");
     break;
   }
 
   /* Create a new vdev based on $params and $physical */
   while (1) {
+    start = trace_begin();
     trans = xs_transaction_start(xs_handle);
 
     xenstore_mkdir_with_perms(trans, 0, domid, VBD_BACKEND_FORMAT, domid, vdev);
@@ -162,9 +212,15 @@ static void recreate(int domid, int vdev, const char *params, const char *type,
     xenstore_fe_write(trans, domid, vdev, "backend-uuid",    "00000000-0000-0000-0000-000000000000");
 
     if (xs_transaction_end(xs_handle, trans, false) == false) {
-      if (errno == EAGAIN)
+      if (errno == EAGAIN) {
+	trace_end(start, "xs_transaction_conflict", domid, "create vdev");
+	log(LOG_DEBUG, "xenstore transaction \"create vdev\" for domid %d vdev %d conflicted, retrying", domid, vdev);
 	continue;
+      }
+      trace_end(start, "xs_transaction_failed", domid, "create vdev");
+      break;
     }
+    trace_end(start, "xs_transaction", domid, "create vdev");
     break;
   }
 }
@@ -172,8 +228,10 @@ static void recreate(int domid, int vdev, const char *params, const char *type,
 static void cdrom_change(int domid, int vdev, const char *params, const char *type, const char *new_physical)
 {
   xs_transaction_t trans;
+  uint64_t start;
 
   while (1) {
+    start = trace_begin();
     trans = xs_transaction_start(xs_handle);
 
     xenstore_be_write(trans, domid, vdev, "params", params);
@@ -182,9 +240,15 @@ static void cdrom_change(int domid, int vdev, const char *params, const char *ty
       xenstore_be_write(trans, domid, vdev, "physical-device", new_physical);
 
     if (xs_transaction_end(xs_handle, trans, false) == false) {
-      if (errno == EAGAIN)
+      if (errno == EAGAIN) {
+	trace_end(start, "xs_transaction_conflict", domid, "change media");
+	log(LOG_DEBUG, "xenstore transaction \"change media\" for domid %d vdev %d conflicted, retrying", domid, vdev);
 	continue;
+      }
+      trace_end(start, "xs_transaction_failed", domid, "change media");
+      break;
     }
+    trace_end(start, "xs_transaction", domid, "change media");
     break;
   }
 }
@@ -192,8 +256,11 @@ static void cdrom_change(int domid, int vdev, const char *params, const char *ty
 static bool cdrom_tap_close_and_load(int tap_minor, const char *params, bool close)
 {
   tap_list_t **list, **tmp, *tap = NULL;
+  uint64_t start;
 
+  start = trace_begin();
   tap_ctl_list(&list);
+  trace_end(start, "tap_ctl_list", -1, NULL);
   tmp = list;
   while(*tmp != NULL) {
     if ((*tmp)->minor == tap_minor) {
@@ -206,9 +273,13 @@ static bool cdrom_tap_close_and_load(int tap_minor, const char *params, bool clo
     return false;
   if (close) {
     /* The last argument should be != 0 for force, but it's not supported */
+    start = trace_begin();
     tap_ctl_close(tap->id, tap_minor, 0);
+    trace_end(start, "tap_ctl_close", -1, NULL);
   }
+  start = trace_begin();
   tap_ctl_open_flags(tap->id, tap_minor, params, TAPDISK_MESSAGE_FLAG_RDONLY);
+  trace_end(start, "tap_ctl_open", -1, params);
   tap_ctl_free_list(list);
 
   return true;
@@ -217,8 +288,11 @@ static bool cdrom_tap_close_and_load(int tap_minor, const char *params, bool clo
 static bool cdrom_tap_destroy(int tap_minor)
 {
   tap_list_t **list, **tmp, *tap = NULL;
+  uint64_t start;
 
+  start = trace_begin();
   tap_ctl_list(&list);
+  trace_end(start, "tap_ctl_list", -1, NULL);
   tmp = list;
   while(*tmp != NULL) {
     if ((*tmp)->minor == tap_minor) {
@@ -229,7 +303,9 @@ static bool cdrom_tap_destroy(int tap_minor)
   }
   if (tap == NULL)
     return false;
+  start = trace_begin();
   tap_ctl_destroy(tap->id, tap_minor);
+  trace_end(start, "tap_ctl_destroy", -1, NULL);
   tap_ctl_free_list(list);
 
   return true;
@@ -239,8 +315,11 @@ static int find_tap_with_path(const char *path)
 {
   tap_list_t **list, **tmp, *tap = NULL;
   int minor = -1;
+  uint64_t start;
 
+  start = trace_begin();
   tap_ctl_list(&list);
+  trace_end(start, "tap_ctl_list", -1, NULL);
   tmp = list;
   /* A closed tapdev will have a NULL path */
   while(*tmp != NULL && (*tmp)->path != NULL) {
@@ -258,6 +337,117 @@ static int find_tap_with_path(const char *path)
   return minor;
 }
 
+/**
+ * @brief Rebuild the state snapshot served by the dbus query methods
+ *
+ * Walks the vbd backends and the tapdisk list once, then publishes the
+ * result with snapshot_publish(). If either walk fails, the current
+ * snapshot is kept, rather than replaced by an incomplete one.
+ *
+ * @param trace Record spans, only when refreshing as part of a request
+ *              so watch-driven refreshes don't flood the trace buffer
+ * @return false if the snapshot couldn't be rebuilt
+ */
+bool blktap_snapshot_refresh(bool trace)
+{
+  struct cdrom_snapshot *snap;
+  struct cdrom_mapping *m;
+  struct cdrom_tapdisk *t;
+  tap_list_t **list = NULL, **tmp;
+  char **domids, *params;
+  unsigned int i, count = 0, n;
+  uint64_t start, lstart;
+  int err;
+
+  snap = calloc(1, sizeof(*snap));
+  if (snap == NULL)
+    return false;
+
+  start = trace ? trace_begin() : 0;
+  lstart = trace ? trace_begin() : 0;
+  err = tap_ctl_list(&list);
+  trace_end(lstart, "tap_ctl_list", -1, NULL);
+  if (err != 0) {
+    log(LOG_WARNING, "tap_ctl_list failed, keeping the current snapshot");
+    goto fail;
+  }
+  for (n = 0; list != NULL && list[n] != NULL; ++n);
+  if (n > 0) {
+    snap->tapdisks = calloc(n, sizeof(*snap->tapdisks));
+    if (snap->tapdisks == NULL) {
+      tap_ctl_free_list(list);
+      goto fail;
+    }
+  }
+  for (tmp = list; tmp != NULL && *tmp != NULL; ++tmp) {
+    t = &snap->tapdisks[snap->n_tapdisks];
+    t->minor = (*tmp)->minor;
+    t->pid = (*tmp)->pid;
+    /* A closed tapdev will have a NULL path */
+    t->path = strdup((*tmp)->path ? (*tmp)->path : "");
+    if (t->path == NULL) {
+      tap_ctl_free_list(list);
+      goto fail;
+    }
+    snap->n_tapdisks++;
+  }
+  if (list != NULL)
+    tap_ctl_free_list(list);
+
+  domids = xs_directory(xs_handle, XBT_NULL, VBD_BACKEND_ROOT, &count);
+  if (domids == NULL) {
+    log(LOG_WARNING, "Failed to list %s, keeping the current snapshot", VBD_BACKEND_ROOT);
+    goto fail;
+  }
+  if (count > 0) {
+    snap->mappings = calloc(count, sizeof(*snap->mappings));
+    if (snap->mappings == NULL) {
+      free(domids);
+      goto fail;
+    }
+  }
+  for (i = 0; i < count; ++i) {
+    m = &snap->mappings[snap->n_mappings];
+    m->domid = strtol(domids[i], NULL, 10);
+    m->vdev = cdrom_vdev_of_domid(m->domid);
+    if (m->vdev < 0)
+      continue;
+    m->tap_minor = cdrom_tap_minor_of_vdev(m->domid, m->vdev);
+    params = xenstore_be_read(XBT_NULL, m->domid, m->vdev, "params");
+    if (params == NULL || *params == '\0') {
+      /* Ejected */
+      m->path = strdup("");
+    } else if (tapdev_minor(params) >= 0) {
+      /* The ISO is the one the tapdisk has open */
+      for (n = 0; n < snap->n_tapdisks; ++n)
+	if (snap->tapdisks[n].minor == tapdev_minor(params))
+	  break;
+      m->path = strdup(n < snap->n_tapdisks ? snap->tapdisks[n].path : "");
+    } else {
+      /* Changed in place, params is the ISO itself */
+      m->path = strdup(params);
+    }
+    free(params);
+    if (m->path == NULL) {
+      free(domids);
+      goto fail;
+    }
+    snap->n_mappings++;
+  }
+  free(domids);
+
+  snapshot_publish(snap);
+  trace_end(start, "snapshot_refresh", -1, NULL);
+
+  return true;
+
+fail:
+  snapshot_free(snap);
+  trace_end(start, "snapshot_refresh_failed", -1, NULL);
+
+  return false;
+}
+
 /*
  * There are 3 possible cases here:
  * 1. There is already a tapdev for the iso we're trying to switch to
@@ -275,10 +465,13 @@ bool blktap_change_iso(const char *path, int domid)
 {
   int tap_minor, count, vdev, existing;
   char tpath[256], phys[16], *new_tpath = NULL;
+  uint64_t start;
 
   /* Get the virtual cdrom vdev and tap minor for the domid */
+  start = trace_begin();
   vdev = cdrom_vdev_of_domid(domid);
   tap_minor = cdrom_tap_minor_of_vdev(domid, vdev);
+  trace_end(start, "find_cdrom", domid, NULL);
 
   /* If we don't have a virtual drive, fail. */
   if (tap_minor < 0)
@@ -292,7 +485,9 @@ bool blktap_change_iso(const char *path, int domid)
     return true;
 
   /* See if there's other guests using the tapdev (we already ejected it) */
+  start = trace_begin();
   count = cdrom_count_and_print(tap_minor, 1, false);
+  trace_end(start, "count_users", domid, NULL);
 
   /* Inserting the new iso */
 
@@ -306,7 +501,7 @@ bool blktap_change_iso(const char *path, int domid)
 	cdrom_tap_destroy(tap_minor);
       /* Switch to the one we just found */
       snprintf(tpath, sizeof(tpath), "/dev/xen/blktap-2/tapdev%d", existing);
-      snprintf(phys, sizeof(phys), "fe:%d", existing);
+      snprintf(phys, sizeof(phys), "fe:%x", existing);
       recreate(domid, vdev, tpath, "phy", phys, tpath);
       return true;
     }
@@ -317,11 +512,17 @@ bool blktap_change_iso(const char *path, int domid)
       cdrom_change(domid, vdev, path, "phy", NULL);
   } else {
     /* 3. We need to create a new tapdev */
-    if (tap_ctl_create_flags(tpath, &new_tpath, TAPDISK_MESSAGE_FLAG_RDONLY) != 0)
-      printf("tap_ctl_create_flags failed!!");
-    tap_minor = strtol(new_tpath + 24, NULL, 10);
-    snprintf(phys, sizeof(phys), "fe:%d", tap_minor);
+    start = trace_begin();
+    if (tap_ctl_create_flags(tpath, &new_tpath, TAPDISK_MESSAGE_FLAG_RDONLY) != 0) {
+      trace_end(start, "tap_ctl_create_failed", domid, tpath);
+      log(LOG_ERR, "tap_ctl_create_flags failed for %s", tpath);
+      return false;
+    }
+    trace_end(start, "tap_ctl_create", domid, tpath);
+    tap_minor = tapdev_minor(new_tpath);
+    snprintf(phys, sizeof(phys), "fe:%x", tap_minor);
     recreate(domid, vdev, new_tpath, "phy", phys, tpath);
+    free(new_tpath);
   }
 
   return true;
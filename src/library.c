@@ -0,0 +1,586 @@
+/*
+ * Copyright (c) 2026 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   library.c
+ * @author agent <agent@local>
+ * @date   19 Oct 2026
+ *
+ * @brief  ISO library
+ *
+ * Index of the ISOs available in the library directories.
+ * The index is built once at startup by a pool of threads walking the
+ * directories in parallel, then kept up to date from inotify events
+ * handled in the main loop. Lookups by path go through a hash table,
+ * listings through a sequence sorted by file name.
+ * Everything indexed ends up in dbus strings, so files whose path isn't
+ * valid UTF-8 are left out.
+ */
+
+#include "project.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#define LIBRARY_WALK_THREADS 4
+#define LIBRARY_MAX_DIRS     16
+
+#define LIBRARY_DIR_EVENTS (IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | \
+			    IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+/* ISO9660 primary volume descriptor, the first one is at sector 16 */
+#define ISO_SECTOR_SIZE   2048
+#define ISO_PVD_OFFSET    (16 * ISO_SECTOR_SIZE)
+#define ISO_PVD_LABEL     40
+#define ISO_PVD_LABEL_LEN 32
+
+static char          *library_dirs[LIBRARY_MAX_DIRS];
+static unsigned int   n_library_dirs = 0;
+static int            library_fd = -1;
+static GHashTable    *by_path = NULL; /**< path -> struct iso_entry */
+static GSequence     *by_name = NULL; /**< struct iso_entry, sorted by name */
+static GHashTable    *watches = NULL; /**< inotify wd -> directory path */
+
+/* State shared by the walker threads */
+struct library_walk {
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  GQueue          dirs;     /**< Directories left to read */
+  unsigned int    busy;     /**< Threads currently reading a directory */
+  GPtrArray      *entries;  /**< ISOs found */
+  GArray         *wds;      /**< inotify watches added */
+  GPtrArray      *wd_paths; /**< Directory of each watch, same order */
+};
+
+static int entry_cmp(gconstpointer a, gconstpointer b, gpointer data)
+{
+  const struct iso_entry *ea = a, *eb = b;
+  int res;
+
+  res = g_ascii_strcasecmp(ea->name, eb->name);
+  if (res == 0)
+    res = strcmp(ea->path, eb->path);
+
+  return res;
+}
+
+/* Orders entries against a name prefix, never equal, see iso_library_search() */
+struct library_bound {
+  const char *prefix;
+  size_t      len;
+  bool        upper; /**< Place the bound after the matches, not before */
+};
+
+static int bound_cmp(gconstpointer a, gconstpointer b, gpointer data)
+{
+  const struct iso_entry *entry = a;
+  const struct library_bound *bound = data;
+  int res;
+
+  res = g_ascii_strncasecmp(entry->name, bound->prefix, bound->len);
+
+  return (res < 0 || (res == 0 && bound->upper)) ? -1 : 1;
+}
+
+static void entry_free(gpointer data)
+{
+  struct iso_entry *entry = data;
+
+  g_free(entry->path);
+  g_free(entry);
+}
+
+static bool is_iso(const char *name)
+{
+  size_t len = strlen(name);
+
+  return len > 4 && !g_ascii_strcasecmp(name + len - 4, ".iso");
+}
+
+/* Read the volume label from the primary volume descriptor, if any */
+static void read_label(int fd, char *label)
+{
+  unsigned char pvd[ISO_PVD_LABEL + ISO_PVD_LABEL_LEN];
+  int i, len = 0;
+
+  *label = '\0';
+  if (pread(fd, pvd, sizeof(pvd), ISO_PVD_OFFSET) != sizeof(pvd))
+    return;
+  if (pvd[0] != 1 || memcmp(pvd + 1, "CD001", 5))
+    return;
+
+  /* The label should be ASCII, padded with spaces. Anything else is
+   * dropped, it has to go in a dbus string. */
+  for (i = 0; i < ISO_PVD_LABEL_LEN; ++i)
+    if (g_ascii_isprint(pvd[ISO_PVD_LABEL + i]))
+      label[len++] = pvd[ISO_PVD_LABEL + i];
+  while (len > 0 && label[len - 1] == ' ')
+    len--;
+  label[len] = '\0';
+}
+
+static struct iso_entry *entry_new(const char *path)
+{
+  struct iso_entry *entry;
+  struct stat st;
+  int fd;
+
+  /* Couldn't be listed nor passed to change_iso over dbus anyway */
+  if (!g_utf8_validate(path, -1, NULL)) {
+    log(LOG_WARNING, "Skipping %s, its path isn't valid UTF-8", path);
+    return NULL;
+  }
+
+  fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return NULL;
+  }
+
+  entry = g_new0(struct iso_entry, 1);
+  entry->path = g_strdup(path);
+  entry->name = strrchr(entry->path, '/') + 1;
+  entry->size = st.st_size;
+  entry->dev = st.st_dev;
+  entry->ino = st.st_ino;
+  read_label(fd, entry->label);
+  close(fd);
+
+  return entry;
+}
+
+static void entry_insert(struct iso_entry *entry)
+{
+  struct iso_entry *old;
+
+  /* The hash table key belongs to the entry, drop it before freeing */
+  old = g_hash_table_lookup(by_path, entry->path);
+  if (old != NULL) {
+    g_hash_table_remove(by_path, entry->path);
+    g_sequence_remove(old->iter);
+  }
+  entry->iter = g_sequence_insert_sorted(by_name, entry, entry_cmp, NULL);
+  g_hash_table_insert(by_path, entry->path, entry);
+}
+
+static void entry_remove(const char *path)
+{
+  struct iso_entry *entry;
+
+  entry = g_hash_table_lookup(by_path, path);
+  if (entry == NULL)
+    return;
+  g_hash_table_remove(by_path, path);
+  g_sequence_remove(entry->iter);
+}
+
+static void walk_dir(struct library_walk *walk, const char *dir)
+{
+  DIR *d;
+  struct dirent *de;
+  struct iso_entry *entry;
+  struct stat st;
+  char *path;
+  unsigned char type;
+  int wd;
+
+  /* Watch first, so nothing created while we read gets missed */
+  wd = -1;
+  if (library_fd >= 0 && (wd = inotify_add_watch(library_fd, dir, LIBRARY_DIR_EVENTS)) < 0)
+    log(LOG_WARNING, "Failed to watch %s: %s", dir, strerror(errno));
+
+  d = opendir(dir);
+  if (d == NULL) {
+    log(LOG_WARNING, "Failed to open %s: %s", dir, strerror(errno));
+    return;
+  }
+
+  pthread_mutex_lock(&walk->lock);
+  if (wd >= 0) {
+    g_array_append_val(walk->wds, wd);
+    g_ptr_array_add(walk->wd_paths, g_strdup(dir));
+  }
+  pthread_mutex_unlock(&walk->lock);
+
+  while ((de = readdir(d)) != NULL) {
+    if (de->d_name[0] == '.')
+      continue;
+    path = g_build_filename(dir, de->d_name, NULL);
+    type = de->d_type;
+    /* Not every filesystem fills d_type */
+    if (type == DT_UNKNOWN && lstat(path, &st) == 0)
+      type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+    if (type == DT_DIR) {
+      pthread_mutex_lock(&walk->lock);
+      g_queue_push_tail(&walk->dirs, path);
+      pthread_cond_signal(&walk->cond);
+      pthread_mutex_unlock(&walk->lock);
+      continue;
+    }
+    if (type == DT_REG && is_iso(de->d_name)) {
+      entry = entry_new(path);
+      if (entry != NULL) {
+	pthread_mutex_lock(&walk->lock);
+	g_ptr_array_add(walk->entries, entry);
+	pthread_mutex_unlock(&walk->lock);
+      }
+    }
+    g_free(path);
+  }
+  closedir(d);
+}
+
+static void *walk_thread(void *arg)
+{
+  struct library_walk *walk = arg;
+  char *dir;
+
+  pthread_mutex_lock(&walk->lock);
+  while (1) {
+    dir = g_queue_pop_head(&walk->dirs);
+    if (dir == NULL) {
+      /* Nothing queued and nobody left to queue more: we're done */
+      if (walk->busy == 0)
+	break;
+      pthread_cond_wait(&walk->cond, &walk->lock);
+      continue;
+    }
+    walk->busy++;
+    pthread_mutex_unlock(&walk->lock);
+
+    walk_dir(walk, dir);
+    g_free(dir);
+
+    pthread_mutex_lock(&walk->lock);
+    walk->busy--;
+    if (walk->busy == 0 && g_queue_is_empty(&walk->dirs))
+      pthread_cond_broadcast(&walk->cond);
+  }
+  pthread_mutex_unlock(&walk->lock);
+
+  return NULL;
+}
+
+/* Index dir and everything under it, using a pool of threads */
+static void library_walk(const char *dir)
+{
+  struct library_walk walk;
+  pthread_t threads[LIBRARY_WALK_THREADS];
+  unsigned int i, n = 0;
+
+  pthread_mutex_init(&walk.lock, NULL);
+  pthread_cond_init(&walk.cond, NULL);
+  g_queue_init(&walk.dirs);
+  walk.busy = 0;
+  walk.entries = g_ptr_array_new();
+  walk.wds = g_array_new(FALSE, FALSE, sizeof(int));
+  walk.wd_paths = g_ptr_array_new();
+  g_queue_push_tail(&walk.dirs, g_strdup(dir));
+
+  for (i = 0; i < LIBRARY_WALK_THREADS; ++i)
+    if (pthread_create(&threads[n], NULL, walk_thread, &walk) == 0)
+      n++;
+  /* Couldn't get any thread, do it ourselves */
+  if (n == 0)
+    walk_thread(&walk);
+  for (i = 0; i < n; ++i)
+    pthread_join(threads[i], NULL);
+
+  for (i = 0; i < walk.wds->len; ++i)
+    g_hash_table_replace(watches,
+			 GINT_TO_POINTER(g_array_index(walk.wds, int, i)),
+			 g_ptr_array_index(walk.wd_paths, i));
+  for (i = 0; i < walk.entries->len; ++i)
+    entry_insert(g_ptr_array_index(walk.entries, i));
+
+  g_ptr_array_free(walk.entries, TRUE);
+  g_array_free(walk.wds, TRUE);
+  g_ptr_array_free(walk.wd_paths, TRUE);
+  pthread_cond_destroy(&walk.cond);
+  pthread_mutex_destroy(&walk.lock);
+}
+
+static bool is_under(const char *path, const char *dir, size_t len)
+{
+  return !strncmp(path, dir, len) && (path[len] == '/' || path[len] == '\0');
+}
+
+/*
+ * Drop every ISO under dir, and stop watching dir and its subdirectories,
+ * when it's deleted or moved away
+ */
+static void library_forget(const char *dir)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+  struct iso_entry *entry;
+  char *tmp;
+  size_t len;
+
+  /* dir may be one of the watch paths we're about to free */
+  tmp = g_strdup(dir);
+  len = strlen(tmp);
+
+  g_hash_table_iter_init(&iter, by_path);
+  while (g_hash_table_iter_next(&iter, &key, &value)) {
+    entry = value;
+    if (is_under(entry->path, tmp, len)) {
+      g_hash_table_iter_remove(&iter);
+      g_sequence_remove(entry->iter);
+    }
+  }
+
+  g_hash_table_iter_init(&iter, watches);
+  while (g_hash_table_iter_next(&iter, &key, &value)) {
+    if (is_under(value, tmp, len)) {
+      inotify_rm_watch(library_fd, GPOINTER_TO_INT(key));
+      g_hash_table_iter_remove(&iter);
+    }
+  }
+
+  g_free(tmp);
+}
+
+static bool is_library_dir(const char *dir)
+{
+  unsigned int i;
+
+  for (i = 0; i < n_library_dirs; ++i)
+    if (!strcmp(library_dirs[i], dir))
+      return true;
+
+  return false;
+}
+
+static void library_rebuild(void)
+{
+  GHashTableIter iter;
+  gpointer key;
+  struct stat st;
+  unsigned int i;
+
+  /* The walk adds new watches, the old ones would keep firing */
+  g_hash_table_iter_init(&iter, watches);
+  while (g_hash_table_iter_next(&iter, &key, NULL))
+    inotify_rm_watch(library_fd, GPOINTER_TO_INT(key));
+  g_hash_table_remove_all(watches);
+  g_hash_table_remove_all(by_path);
+  g_sequence_remove_range(g_sequence_get_begin_iter(by_name),
+			  g_sequence_get_end_iter(by_name));
+  for (i = 0; i < n_library_dirs; ++i) {
+    if (stat(library_dirs[i], &st) != 0 || !S_ISDIR(st.st_mode)) {
+      log(LOG_ERR, "ISO library directory %s is missing, it won't be indexed", library_dirs[i]);
+      continue;
+    }
+    library_walk(library_dirs[i]);
+  }
+}
+
+/**
+ * @brief Add a directory to the ISO library
+ *
+ * Must be called before iso_library_init()
+ */
+void iso_library_add_dir(const char *dir)
+{
+  char *tmp;
+  size_t len;
+
+  if (n_library_dirs >= LIBRARY_MAX_DIRS) {
+    log(LOG_ERR, "Too many ISO directories, ignoring %s", dir);
+    return;
+  }
+  tmp = g_strdup(dir);
+  len = strlen(tmp);
+  while (len > 1 && tmp[len - 1] == '/')
+    tmp[--len] = '\0';
+  library_dirs[n_library_dirs++] = tmp;
+}
+
+/**
+ * @brief Build the ISO library index
+ *
+ * @return The inotify file descriptor to select on, -1 if there is none
+ */
+int iso_library_init(void)
+{
+  by_path = g_hash_table_new(g_str_hash, g_str_equal);
+  by_name = g_sequence_new(entry_free);
+  watches = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+
+  library_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (library_fd < 0)
+    log(LOG_ERR, "Failed to init inotify, the ISO library won't be updated");
+
+  library_rebuild();
+  log(LOG_INFO, "%u ISOs in the library", g_hash_table_size(by_path));
+
+  return library_fd;
+}
+
+static void library_event(const struct inotify_event *ev)
+{
+  const char *dir;
+  char *path;
+  struct iso_entry *entry;
+
+  if (ev->mask & IN_Q_OVERFLOW) {
+    log(LOG_WARNING, "ISO library events overflowed, rebuilding the index");
+    library_rebuild();
+    return;
+  }
+  if (ev->mask & IN_IGNORED) {
+    g_hash_table_remove(watches, GINT_TO_POINTER(ev->wd));
+    return;
+  }
+
+  dir = g_hash_table_lookup(watches, GINT_TO_POINTER(ev->wd));
+  if (dir == NULL)
+    return;
+  /*
+   * A subdirectory going away is handled from its parent's
+   * IN_MOVED_FROM/IN_DELETE, only the library directories need this.
+   * By the time the IN_MOVE_SELF of a renamed subdirectory shows up,
+   * its watch may already point to the new path.
+   */
+  if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+    if (is_library_dir(dir)) {
+      log(LOG_ERR, "ISO library directory %s went away, it won't be indexed anymore", dir);
+      library_forget(dir);
+    }
+    return;
+  }
+  if (ev->len == 0 || ev->name[0] == '.')
+    return;
+
+  path = g_build_filename(dir, ev->name, NULL);
+  if (ev->mask & IN_ISDIR) {
+    /* The watch of a removed directory goes away on its own */
+    if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+      library_walk(path);
+    else if (ev->mask & IN_MOVED_FROM)
+      library_forget(path);
+  } else if (is_iso(ev->name)) {
+    if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+      entry_remove(path);
+    else if ((entry = entry_new(path)) != NULL)
+      entry_insert(entry);
+  }
+  g_free(path);
+}
+
+/**
+ * @brief Apply the pending inotify events to the index, without blocking
+ */
+void iso_library_handle_events(void)
+{
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev;
+  ssize_t len;
+  char *p;
+
+  while ((len = read(library_fd, buf, sizeof(buf))) > 0) {
+    for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+      ev = (const struct inotify_event *)p;
+      library_event(ev);
+    }
+  }
+}
+
+/**
+ * @brief Look up an ISO by path
+ *
+ * @return The ISO, or NULL if it's not in the library
+ */
+const struct iso_entry *iso_library_lookup(const char *path)
+{
+  if (by_path == NULL)
+    return NULL;
+
+  return g_hash_table_lookup(by_path, path);
+}
+
+/**
+ * @brief Check that a path is a library ISO, and still the same file
+ */
+bool iso_library_check(const char *path)
+{
+  const struct iso_entry *entry;
+  struct stat st;
+
+  entry = iso_library_lookup(path);
+  if (entry == NULL)
+    return false;
+  if (stat(path, &st) != 0)
+    return false;
+
+  return st.st_dev == entry->dev && st.st_ino == entry->ino;
+}
+
+/**
+ * @brief List the ISOs whose file name starts with prefix (case insensitive)
+ *
+ * @param prefix The prefix to look for, "" for all
+ * @param offset How many matches to skip
+ * @param limit  Maximum number of paths to return, 0 for no limit
+ * @param total  Set to the total number of matches
+ * @return A NULL-terminated array of paths sorted by file name, to be
+ *         freed with g_strfreev()
+ */
+char **iso_library_search(const char *prefix, unsigned int offset, unsigned int limit, unsigned int *total)
+{
+  GPtrArray *res;
+  GSequenceIter *first, *last;
+  struct library_bound bound;
+  struct iso_entry *entry;
+  unsigned int n;
+
+  res = g_ptr_array_new();
+  *total = 0;
+
+  if (by_name != NULL) {
+    /* The matches are contiguous, find where they start and end */
+    bound.prefix = prefix;
+    bound.len = strlen(prefix);
+    bound.upper = false;
+    first = g_sequence_search(by_name, NULL, bound_cmp, &bound);
+    bound.upper = true;
+    last = g_sequence_search(by_name, NULL, bound_cmp, &bound);
+    *total = g_sequence_iter_get_position(last) - g_sequence_iter_get_position(first);
+
+    if (offset < *total) {
+      n = *total - offset;
+      if (limit > 0 && limit < n)
+	n = limit;
+      first = g_sequence_iter_move(first, offset);
+      for (; n > 0; --n, first = g_sequence_iter_next(first)) {
+	entry = g_sequence_get(first);
+	g_ptr_array_add(res, g_strdup(entry->path));
+      }
+    }
+  }
+  g_ptr_array_add(res, NULL);
+
+  return (char **)g_ptr_array_free(res, FALSE);
+}
@@ -0,0 +1,314 @@
+/*
+ * Copyright (c) 2026 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   log.c
+ * @author agent <agent@local>
+ * @date   19 Oct 2026
+ *
+ * @brief  Logging
+ *
+ * Messages are formatted straight into a fixed-size ring buffer and
+ * handed to syslog by a background thread, so a stalled syslog daemon
+ * can never block the main loop. When the ring is full, messages are
+ * dropped and counted instead.
+ */
+
+#include "project.h"
+
+#include <pthread.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#define LOG_RING_SIZE 256 /**< Number of slots in the ring, must be a power of 2 */
+#define LOG_RING_MASK (LOG_RING_SIZE - 1)
+#define LOG_MSG_MAX   240 /**< Longer messages get truncated */
+
+#define LOG_RATELIMIT_INTERVAL 10 /**< Length of a rate-limiting window, in seconds */
+#define LOG_RATELIMIT_BURST    20 /**< Messages allowed per call site per window */
+
+struct log_slot {
+  unsigned long seq;      /**< Slot sequence number, see log_claim() */
+  int level;
+  char msg[LOG_MSG_MAX];
+};
+
+static struct log_slot ring[LOG_RING_SIZE];
+static unsigned long   ring_tail;    /**< Next slot to claim, shared by the producers */
+static unsigned long   ring_head;    /**< Next slot to flush, only used by the writer */
+static unsigned long   ring_dropped; /**< Messages lost because the ring was full */
+
+/* Call sites that suppressed messages, the list only grows */
+static struct log_ratelimit *ratelimited = NULL;
+
+static int       log_level = LOG_INFO;
+static int       log_efd = -1;
+static bool      log_stop = false;
+static bool      log_running = false;
+static pthread_t log_thread;
+
+/* Sequence numbers must be valid before anyone logs, even before log_init() */
+static void __attribute__((constructor)) log_ring_init(void)
+{
+  unsigned long i;
+
+  for (i = 0; i < LOG_RING_SIZE; ++i)
+    ring[i].seq = i;
+}
+
+/*
+ * Claim a slot in the ring. A slot is free for position pos when its
+ * sequence number equals pos, and holds a message ready to be flushed
+ * when it equals pos + 1. Returns NULL when the ring is full.
+ */
+static struct log_slot *log_claim(unsigned long *pos)
+{
+  struct log_slot *slot;
+  unsigned long seq;
+  long diff;
+
+  *pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+  while (1) {
+    slot = &ring[*pos & LOG_RING_MASK];
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    diff = (long)(seq - *pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&ring_tail, pos, *pos + 1, true,
+				      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	return slot;
+    } else if (diff < 0) {
+      __atomic_fetch_add(&ring_dropped, 1, __ATOMIC_RELAXED);
+      return NULL;
+    } else
+      *pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+  }
+}
+
+static void log_wake(void)
+{
+  uint64_t one = 1;
+
+  /* The eventfd is non-blocking, a saturated counter still wakes the writer */
+  if (log_efd >= 0 && write(log_efd, &one, sizeof(one)) < 0)
+    return;
+}
+
+static void log_publish(struct log_slot *slot, unsigned long pos)
+{
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+  log_wake();
+}
+
+static void log_push(int level, const char *format, va_list args)
+{
+  struct log_slot *slot;
+  unsigned long pos;
+
+  slot = log_claim(&pos);
+  if (slot == NULL)
+    return;
+  slot->level = level;
+  vsnprintf(slot->msg, sizeof(slot->msg), format, args);
+  log_publish(slot, pos);
+}
+
+static void log_push_fmt(int level, const char *format, ...)
+{
+  va_list args;
+
+  va_start(args, format);
+  log_push(level, format, args);
+  va_end(args);
+}
+
+/* Returns false if the call site already used up its burst for this window */
+static bool log_ratelimit_pass(struct log_ratelimit *rl, unsigned int *suppressed)
+{
+  struct timespec ts;
+  time_t window;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  window = __atomic_load_n(&rl->window, __ATOMIC_RELAXED);
+  if (ts.tv_sec - window >= LOG_RATELIMIT_INTERVAL &&
+      __atomic_compare_exchange_n(&rl->window, &window, ts.tv_sec, false,
+				  __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    *suppressed = __atomic_exchange_n(&rl->suppressed, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&rl->count, 0, __ATOMIC_RELAXED);
+  }
+
+  if (__atomic_fetch_add(&rl->count, 1, __ATOMIC_RELAXED) >= LOG_RATELIMIT_BURST) {
+    __atomic_fetch_add(&rl->suppressed, 1, __ATOMIC_RELAXED);
+    /* Let the writer report the count even if the site never logs again */
+    if (!__atomic_exchange_n(&rl->listed, true, __ATOMIC_RELAXED)) {
+      rl->next = __atomic_load_n(&ratelimited, __ATOMIC_RELAXED);
+      while (!__atomic_compare_exchange_n(&ratelimited, &rl->next, rl, true,
+					  __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * @brief Queue a message for syslog
+ *
+ * Never blocks. Use the log() macro rather than calling this directly,
+ * it provides the per-call-site rate limiting state.
+ *
+ * @param rl     Rate limiting state of the call site, or NULL
+ * @param level  syslog priority (LOG_ERR, LOG_INFO, ...)
+ * @param format printf-style format
+ */
+void log_message(struct log_ratelimit *rl, int level, const char *format, ...)
+{
+  va_list args;
+  unsigned int suppressed = 0;
+
+  if (level > __atomic_load_n(&log_level, __ATOMIC_RELAXED))
+    return;
+
+  if (rl != NULL && !log_ratelimit_pass(rl, &suppressed))
+    return;
+  if (suppressed > 0)
+    log_push_fmt(LOG_WARNING, "%s:%d: %u similar messages suppressed",
+		 rl->file, rl->line, suppressed);
+
+  va_start(args, format);
+  log_push(level, format, args);
+  va_end(args);
+}
+
+static void log_flush(void)
+{
+  struct log_slot *slot;
+  unsigned long dropped;
+
+  while (1) {
+    slot = &ring[ring_head & LOG_RING_MASK];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ring_head + 1)
+      break;
+    syslog(slot->level, "%s", slot->msg);
+    __atomic_store_n(&slot->seq, ring_head + LOG_RING_SIZE, __ATOMIC_RELEASE);
+    ring_head++;
+  }
+
+  dropped = __atomic_exchange_n(&ring_dropped, 0, __ATOMIC_RELAXED);
+  if (dropped > 0)
+    syslog(LOG_WARNING, "%lu messages dropped, log buffer full", dropped);
+}
+
+/*
+ * Report what the call sites suppressed and didn't report themselves.
+ * Unless all is set, only sites whose window is over are reported, so a
+ * site still flooding gets a single summary.
+ */
+static void log_report_suppressed(bool all)
+{
+  struct log_ratelimit *rl;
+  struct timespec ts;
+  unsigned int suppressed;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  rl = __atomic_load_n(&ratelimited, __ATOMIC_ACQUIRE);
+  for (; rl != NULL; rl = rl->next) {
+    if (!all &&
+	ts.tv_sec - __atomic_load_n(&rl->window, __ATOMIC_RELAXED) < LOG_RATELIMIT_INTERVAL)
+      continue;
+    suppressed = __atomic_exchange_n(&rl->suppressed, 0, __ATOMIC_RELAXED);
+    if (suppressed > 0)
+      syslog(LOG_WARNING, "%s:%d: %u similar messages suppressed",
+	     rl->file, rl->line, suppressed);
+  }
+}
+
+static void *log_writer(void *arg)
+{
+  struct pollfd pfd;
+  uint64_t val;
+
+  pfd.fd = log_efd;
+  pfd.events = POLLIN;
+  while (!__atomic_load_n(&log_stop, __ATOMIC_ACQUIRE)) {
+    /* Wake up once per window at least, for log_report_suppressed() */
+    if (poll(&pfd, 1, LOG_RATELIMIT_INTERVAL * 1000) > 0 &&
+	read(log_efd, &val, sizeof(val)) < 0)
+      continue;
+    log_flush();
+    log_report_suppressed(false);
+  }
+  log_flush();
+  log_report_suppressed(true);
+
+  return NULL;
+}
+
+/**
+ * @brief Set the maximum priority that gets logged
+ */
+void log_set_level(int level)
+{
+  __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Stop the writer thread, flushing what's left in the ring
+ */
+void log_fini(void)
+{
+  if (!log_running)
+    return;
+  __atomic_store_n(&log_stop, true, __ATOMIC_RELEASE);
+  log_wake();
+  pthread_join(log_thread, NULL);
+  log_running = false;
+  close(log_efd);
+  log_efd = -1;
+  closelog();
+}
+
+/**
+ * @brief Initialize logging
+ *
+ * Open syslog and start the writer thread. Messages logged before this
+ * are kept in the ring and flushed once the thread starts.
+ *
+ * @param level The maximum priority that gets logged
+ */
+void log_init(int level)
+{
+  log_set_level(level);
+  openlog("cdrom-daemon", LOG_PID | LOG_NDELAY, LOG_DAEMON);
+
+  log_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (log_efd < 0) {
+    syslog(LOG_ERR, "failed to create the log eventfd, logging disabled");
+    return;
+  }
+  if (pthread_create(&log_thread, NULL, log_writer, NULL) != 0) {
+    syslog(LOG_ERR, "failed to start the log writer, logging disabled");
+    close(log_efd);
+    log_efd = -1;
+    return;
+  }
+  log_running = true;
+  atexit(log_fini);
+
+  /* Flush anything that was queued before the thread existed */
+  log_wake();
+}
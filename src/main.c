@@ -28,14 +28,77 @@
 
 #include "project.h"
 
+#include <signal.h>
+
+/**
+ * How long the vbds must stay quiet before the snapshot is rebuilt,
+ * in milliseconds. A guest boot or a recreate() writes dozens of nodes,
+ * this turns them into a single rebuild.
+ */
+#define VBD_REFRESH_DELAY 200
+
+/**
+ * How long a change can wait for the vbds to settle, in milliseconds.
+ * Past that, the snapshot is rebuilt even if events keep coming.
+ */
+#define VBD_REFRESH_MAX_DELAY 1000
+
+static volatile sig_atomic_t dump_trace = 0;
+
+static void sigusr1_handler(int sig)
+{
+  dump_trace = 1;
+}
+
+static long now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 int
-main() {
+main(int argc, char **argv) {
   int ret = 0;
+  int opt;
+  int level = LOG_INFO;
   struct timeval tv;
   fd_set readfds;
   fd_set writefds;
   fd_set exceptfds;
   int nfds;
+  int xsfd;
+  bool vbds_dirty = false;
+  long vbds_dirty_since = 0;
+  long vbds_changed_at = 0;
+  int isofd;
+  bool isodirs = false;
+
+  while ((opt = getopt(argc, argv, "di:t")) != -1) {
+    switch (opt) {
+    case 'd':
+      level = LOG_DEBUG;
+      break;
+    case 'i':
+      iso_library_add_dir(optarg);
+      isodirs = true;
+      break;
+    case 't':
+      trace_enabled = true;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-d] [-t] [-i iso_dir]...\n", argv[0]);
+      return 1;
+    }
+  }
+
+  /* Setup logging, before anything that could log */
+  log_init(level);
+
+  /* SIGUSR1 dumps the trace */
+  signal(SIGUSR1, sigusr1_handler);
 
   /* Setup dbus */
   rpc_init();
@@ -47,7 +110,19 @@ main() {
     return 1;
   }
 
-  /* TODO: list existing vbds */
+  /* Watch the vbds and take a first snapshot of them */
+  if (!xenstore_watch_vbds())
+    log(LOG_ERR, "Failed to watch the vbd backends, queries may be stale");
+  xsfd = xs_fileno(xs_handle);
+  if (!blktap_snapshot_refresh(false)) {
+    vbds_dirty = true;
+    vbds_dirty_since = vbds_changed_at = now_ms();
+  }
+
+  /* Index the ISO library */
+  if (!isodirs)
+    iso_library_add_dir(ISO_LIBRARY_DEFAULT);
+  isofd = iso_library_init();
 
   /* Main loop */
   while (1) {
@@ -58,9 +133,39 @@ main() {
     tv.tv_sec = 0;
     tv.tv_usec = 1000;
     nfds = xcdbus_pre_select(g_xcbus, 0, &readfds, &writefds, &exceptfds);
+    FD_SET(xsfd, &readfds);
+    if (xsfd >= nfds)
+      nfds = xsfd + 1;
+    if (isofd >= 0) {
+      FD_SET(isofd, &readfds);
+      if (isofd >= nfds)
+	nfds = isofd + 1;
+    }
     select(nfds, &readfds, &writefds, &exceptfds, &tv);
     xcdbus_post_select(g_xcbus, 0, &readfds, &writefds, &exceptfds);
-    /* TODO: watch xenstore for new (domains and) vbds */
+    /* Check xenstore for new, removed or changed vbds */
+    if (FD_ISSET(xsfd, &readfds) && xenstore_vbds_changed()) {
+      vbds_changed_at = now_ms();
+      if (!vbds_dirty)
+	vbds_dirty_since = vbds_changed_at;
+      vbds_dirty = true;
+    }
+    /* Rebuild the snapshot once the changes have settled, or waited too long.
+     * If the rebuild fails, it stays dirty and gets retried. */
+    if (vbds_dirty &&
+	(now_ms() - vbds_changed_at >= VBD_REFRESH_DELAY ||
+	 now_ms() - vbds_dirty_since >= VBD_REFRESH_MAX_DELAY) &&
+	blktap_snapshot_refresh(false))
+      vbds_dirty = false;
+    /* Keep the ISO library index up to date */
+    if (isofd >= 0 && FD_ISSET(isofd, &readfds))
+      iso_library_handle_events();
+    if (dump_trace) {
+      dump_trace = 0;
+      trace_dump_file(TRACE_DUMP_PATH);
+    }
+    /* No dbus handler is running, old snapshots can go */
+    snapshot_quiescent();
   }
 
   return ret;
@@ -45,6 +45,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 
 #ifdef HAVE_MALLOC_H
 #include <malloc.h>
@@ -79,13 +80,48 @@
 #define CDROMDAEMON     "com.citrix.xenclient.cdromdaemon" /**< The dbus name of cdrom daemon */
 #define CDROMDAEMON_OBJ "/"                         /**< The main dbus object of cdrom daemon */
 
+#define ISO_LIBRARY_DEFAULT "/storage/isos"      /**< Used when no -i is given */
+
+#define VBD_BACKEND_ROOT    "/local/domain/0/backend/vbd"
+#define VBD_WATCH_TOKEN     "vbd"
 #define VBD_BACKEND_FORMAT  "/local/domain/0/backend/vbd/%d/%d"
 #define VBD_FRONTEND_FORMAT "/local/domain/%d/device/vbd/%d"
 
 /**
- * The (stupid) logging macro
+ * Per-call-site rate limiting state, see log()
+ */
+struct log_ratelimit {
+  const char           *file;       /**< Call site, named in suppression reports */
+  int                   line;
+  time_t                window;     /**< Start of the current window (monotonic seconds) */
+  unsigned int          count;      /**< Messages logged in the current window */
+  unsigned int          suppressed; /**< Messages dropped and not reported yet */
+  bool                  listed;     /**< On the list the log writer checks */
+  struct log_ratelimit *next;
+};
+
+/**
+ * The logging macro.
+ * I is a syslog priority. Each call site gets its own rate limit.
+ */
+#define log(I, ...) do {				\
+    static struct log_ratelimit __log_rl =		\
+      { .file = __FILE__, .line = __LINE__ };		\
+    log_message(&__log_rl, I, __VA_ARGS__);		\
+  } while (0)
+
+/**
+ * Tracing, see trace.c.
+ * trace_begin() returns 0 when tracing is off, and trace_end() does
+ * nothing for such a span, so disabled tracing costs a single test.
  */
-#define log(I, ...) do { fprintf(stderr, ##__VA_ARGS__); fprintf(stderr, "\n"); } while (0)
+#define TRACE_DUMP_PATH "/var/log/cdrom-daemon-trace.json" /**< Where SIGUSR1 dumps the trace */
+
+#define trace_begin() (__builtin_expect(trace_enabled, 0) ? trace_now() : 0)
+#define trace_end(start, name, domid, detail) do {			\
+    if (__builtin_expect((start) != 0, 0))				\
+      trace_record(start, name, domid, detail);			\
+  } while (0)
 
 enum XenBusStates {
   XB_UNKNOWN,
@@ -97,9 +133,67 @@ enum XenBusStates {
   XB_CLOSED
 };
 
+/**
+ * The virtual CDROM of a guest, as seen in the last snapshot
+ */
+struct cdrom_mapping {
+  int   domid;
+  int   vdev;
+  int   tap_minor;
+  char *path;      /**< The ISO, or "" when the drive is empty */
+};
+
+/**
+ * A tapdisk, as seen in the last snapshot
+ */
+struct cdrom_tapdisk {
+  int   minor;
+  int   pid;
+  char *path;      /**< The ISO, or "" when the tapdisk is closed */
+};
+
+/**
+ * Immutable view of the CDROM state, see snapshot.c
+ */
+struct cdrom_snapshot {
+  unsigned long          generation;
+  unsigned int           n_mappings;
+  struct cdrom_mapping  *mappings;     /**< Sorted by domid */
+  unsigned int           n_tapdisks;
+  struct cdrom_tapdisk  *tapdisks;
+  struct cdrom_snapshot *retired_next;
+};
+
+/**
+ * An ISO of the library, see library.c
+ */
+struct iso_entry {
+  char          *path;
+  const char    *name;   /**< File name, points into path */
+  uint64_t       size;
+  char           label[33]; /**< ISO9660 volume identifier, "" if none */
+  dev_t          dev;
+  ino_t          ino;
+  GSequenceIter *iter;   /**< Position in the by-name index */
+};
+
+extern bool trace_enabled;
+
 struct xs_handle *xs_handle; /**< The global xenstore handle, initialized by xenstore_init() */
 xcdbus_conn_t *g_xcbus;      /**< The global dbus (libxcdbus) handle, initialized by rpc_init() */
 
+void log_init(int level);
+void log_set_level(int level);
+void log_fini(void);
+void log_message(struct log_ratelimit *rl, int level, const char *format, ...)
+  __attribute__((format(printf, 3, 4)));
+
+uint64_t trace_now(void);
+void trace_record(uint64_t start, const char *name, int domid, const char *detail);
+void trace_set_enabled(bool enabled);
+void trace_dump(FILE *f);
+bool trace_dump_file(const char *path);
+
 bool  xenstore_be_write(xs_transaction_t trans, int domid, int vdev, char *node, const char *value, ...);
 bool  xenstore_fe_write(xs_transaction_t trans, int domid, int vdev, char *node, const char *value, ...);
 char *xenstore_be_read(xs_transaction_t trans, int domid, int vdev, char *node);
@@ -107,9 +201,26 @@ char *xenstore_fe_read(xs_transaction_t trans, int domid, int vdev, char *node);
 bool  xenstore_be_destroy(xs_transaction_t trans, int domid, int vdev);
 bool  xenstore_fe_destroy(xs_transaction_t trans, int domid, int vdev);
 bool  xenstore_mkdir_with_perms(xs_transaction_t trans, int owner, int reader, char *dir, ...);
+bool  xenstore_watch_vbds(void);
+bool  xenstore_vbds_changed(void);
 
 bool blktap_change_iso(const char *path, int domid);
+bool blktap_snapshot_refresh(bool trace);
+
+void snapshot_free(struct cdrom_snapshot *snap);
+void snapshot_publish(struct cdrom_snapshot *snap);
+const struct cdrom_snapshot *snapshot_get(void);
+const struct cdrom_mapping *snapshot_find(const struct cdrom_snapshot *snap, int domid);
+void snapshot_quiescent(void);
+
+void iso_library_add_dir(const char *dir);
+int  iso_library_init(void);
+void iso_library_handle_events(void);
+const struct iso_entry *iso_library_lookup(const char *path);
+bool iso_library_check(const char *path);
+char **iso_library_search(const char *prefix, unsigned int offset, unsigned int limit, unsigned int *total);
 
 void rpc_init(void);
+void rpc_notify_mapping_changed(int domid, const char *path);
 
 #endif
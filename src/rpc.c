@@ -67,5 +67,166 @@ gboolean cdrom_daemon_change_iso(CdromDaemonObject *this,
 				 gint IN_domid,
 				 GError** error)
 {
-  return blktap_change_iso(IN_path, IN_domid);
+  gboolean res;
+  uint64_t start;
+
+  /* Only ISOs from the library can be inserted */
+  if (*IN_path != '\0' && !iso_library_check(IN_path)) {
+    g_set_error(error, DBUS_GERROR, DBUS_GERROR_INVALID_ARGS,
+		"%s is not in the ISO library", IN_path);
+    return FALSE;
+  }
+
+  start = trace_begin();
+  res = blktap_change_iso(IN_path, IN_domid);
+  blktap_snapshot_refresh(true);
+  trace_end(start, "change_iso", IN_domid, IN_path);
+
+  return res;
+}
+
+/**
+ * @brief Emit the mapping_changed signal
+ *
+ * @param domid The guest whose virtual CDROM changed
+ * @param path  The new ISO, "" if the drive is now empty or gone
+ */
+void rpc_notify_mapping_changed(int domid, const char *path)
+{
+  DBusMessage *msg;
+  dbus_int32_t id = domid;
+
+  if (g_dbus_conn == NULL)
+    return;
+
+  msg = dbus_message_new_signal(SERVICE_OBJ_PATH, SERVICE, "mapping_changed");
+  if (msg == NULL)
+    return;
+  if (dbus_message_append_args(msg,
+			       DBUS_TYPE_INT32, &id,
+			       DBUS_TYPE_STRING, &path,
+			       DBUS_TYPE_INVALID))
+    dbus_connection_send(g_dbus_conn, msg, NULL);
+  dbus_message_unref(msg);
+}
+
+/*
+ * The query methods below are served from the state snapshot only,
+ * they never touch xenstore or tapdisks.
+ */
+
+gboolean cdrom_daemon_get_iso(CdromDaemonObject *this,
+			      gint IN_domid,
+			      char **OUT_path,
+			      GError** error)
+{
+  const struct cdrom_mapping *m;
+
+  m = snapshot_find(snapshot_get(), IN_domid);
+  *OUT_path = g_strdup(m != NULL ? m->path : "");
+
+  return TRUE;
+}
+
+gboolean cdrom_daemon_list_mappings(CdromDaemonObject *this,
+				    GHashTable **OUT_mappings,
+				    GError** error)
+{
+  const struct cdrom_snapshot *snap = snapshot_get();
+  unsigned int i;
+
+  *OUT_mappings = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+  for (i = 0; i < snap->n_mappings; ++i)
+    g_hash_table_insert(*OUT_mappings,
+			GINT_TO_POINTER(snap->mappings[i].domid),
+			g_strdup(snap->mappings[i].path));
+
+  return TRUE;
+}
+
+gboolean cdrom_daemon_list_tapdisks(CdromDaemonObject *this,
+				    GHashTable **OUT_tapdisks,
+				    GError** error)
+{
+  const struct cdrom_snapshot *snap = snapshot_get();
+  unsigned int i;
+
+  *OUT_tapdisks = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+  for (i = 0; i < snap->n_tapdisks; ++i)
+    g_hash_table_insert(*OUT_tapdisks,
+			GINT_TO_POINTER(snap->tapdisks[i].minor),
+			g_strdup(snap->tapdisks[i].path));
+
+  return TRUE;
+}
+
+/*
+ * ISO library browsing, served from the library index
+ */
+
+gboolean cdrom_daemon_list_isos(CdromDaemonObject *this,
+				const char* IN_prefix,
+				guint IN_offset,
+				guint IN_limit,
+				char ***OUT_paths,
+				guint *OUT_total,
+				GError** error)
+{
+  *OUT_paths = iso_library_search(IN_prefix, IN_offset, IN_limit, OUT_total);
+
+  return TRUE;
+}
+
+gboolean cdrom_daemon_get_iso_info(CdromDaemonObject *this,
+				   const char* IN_path,
+				   guint64 *OUT_size,
+				   char **OUT_label,
+				   GError** error)
+{
+  const struct iso_entry *entry;
+
+  entry = iso_library_lookup(IN_path);
+  if (entry == NULL) {
+    g_set_error(error, DBUS_GERROR, DBUS_GERROR_INVALID_ARGS,
+		"%s is not in the ISO library", IN_path);
+    return FALSE;
+  }
+  *OUT_size = entry->size;
+  *OUT_label = g_strdup(entry->label);
+
+  return TRUE;
+}
+
+/*
+ * Tracing
+ */
+
+gboolean cdrom_daemon_set_tracing(CdromDaemonObject *this,
+				  gboolean IN_enabled,
+				  GError** error)
+{
+  trace_set_enabled(IN_enabled);
+
+  return TRUE;
+}
+
+gboolean cdrom_daemon_dump_trace(CdromDaemonObject *this,
+				 char **OUT_json,
+				 GError** error)
+{
+  FILE *f;
+  char *buf = NULL;
+  size_t len = 0;
+
+  f = open_memstream(&buf, &len);
+  if (f == NULL) {
+    g_set_error(error, DBUS_GERROR, DBUS_GERROR_NO_MEMORY, "failed to dump the trace");
+    return FALSE;
+  }
+  trace_dump(f);
+  fclose(f);
+  *OUT_json = g_strdup(buf);
+  free(buf);
+
+  return TRUE;
 }
@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2026 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   snapshot.c
+ * @author agent <agent@local>
+ * @date   19 Oct 2026
+ *
+ * @brief  Read-only view of the CDROM state
+ *
+ * The dbus query methods are answered from an immutable snapshot of
+ * which ISO each guest has, rebuilt by blktap_snapshot_refresh().
+ * A new snapshot is published with a single pointer swap. Readers only
+ * run from the main loop, so a replaced snapshot is freed on the next
+ * snapshot_quiescent(), once no reader can still hold it.
+ */
+
+#include "project.h"
+
+static struct cdrom_snapshot  empty_snapshot;
+static struct cdrom_snapshot *current = &empty_snapshot;
+static struct cdrom_snapshot *retired = NULL; /**< Replaced snapshots waiting to be freed */
+
+static int mapping_cmp(const void *a, const void *b)
+{
+  const struct cdrom_mapping *ma = a, *mb = b;
+
+  return ma->domid - mb->domid;
+}
+
+/**
+ * @brief Free a snapshot
+ *
+ * Only for snapshots that were never published, published ones are
+ * freed by snapshot_quiescent().
+ */
+void snapshot_free(struct cdrom_snapshot *snap)
+{
+  unsigned int i;
+
+  if (snap == &empty_snapshot)
+    return;
+  for (i = 0; i < snap->n_mappings; ++i)
+    free(snap->mappings[i].path);
+  for (i = 0; i < snap->n_tapdisks; ++i)
+    free(snap->tapdisks[i].path);
+  free(snap->mappings);
+  free(snap->tapdisks);
+  free(snap);
+}
+
+/* Signal the domids whose ISO differs between the two snapshots */
+static void snapshot_notify(const struct cdrom_snapshot *old, const struct cdrom_snapshot *new)
+{
+  unsigned int i = 0, j = 0;
+  const struct cdrom_mapping *mo, *mn;
+
+  /* Both mapping arrays are sorted by domid */
+  while (i < old->n_mappings || j < new->n_mappings) {
+    mo = (i < old->n_mappings) ? &old->mappings[i] : NULL;
+    mn = (j < new->n_mappings) ? &new->mappings[j] : NULL;
+    if (mn == NULL || (mo != NULL && mo->domid < mn->domid)) {
+      rpc_notify_mapping_changed(mo->domid, "");
+      i++;
+    } else if (mo == NULL || mn->domid < mo->domid) {
+      rpc_notify_mapping_changed(mn->domid, mn->path);
+      j++;
+    } else {
+      if (strcmp(mo->path, mn->path))
+	rpc_notify_mapping_changed(mn->domid, mn->path);
+      i++;
+      j++;
+    }
+  }
+}
+
+/**
+ * @brief Publish a new snapshot
+ *
+ * Takes ownership of snap, which must not be modified afterwards.
+ * Emits mapping_changed for every guest whose ISO changed, except on
+ * the first publish.
+ */
+void snapshot_publish(struct cdrom_snapshot *snap)
+{
+  struct cdrom_snapshot *old;
+
+  qsort(snap->mappings, snap->n_mappings, sizeof(*snap->mappings), mapping_cmp);
+  snap->generation = current->generation + 1;
+
+  old = __atomic_exchange_n(&current, snap, __ATOMIC_ACQ_REL);
+  /* The first snapshot is the initial state, not a change */
+  if (old != &empty_snapshot) {
+    snapshot_notify(old, snap);
+    old->retired_next = retired;
+    retired = old;
+  }
+}
+
+/**
+ * @brief Get the current snapshot
+ *
+ * Never blocks and never touches xenstore. The returned snapshot stays
+ * valid until the caller returns to the main loop.
+ */
+const struct cdrom_snapshot *snapshot_get(void)
+{
+  return __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Look up the mapping of a guest in a snapshot
+ *
+ * @return The mapping, or NULL if the guest has no virtual CDROM
+ */
+const struct cdrom_mapping *snapshot_find(const struct cdrom_snapshot *snap, int domid)
+{
+  struct cdrom_mapping key;
+
+  key.domid = domid;
+  return bsearch(&key, snap->mappings, snap->n_mappings, sizeof(key), mapping_cmp);
+}
+
+/**
+ * @brief Free the replaced snapshots
+ *
+ * Must be called from the main loop, outside of any dbus handler.
+ */
+void snapshot_quiescent(void)
+{
+  struct cdrom_snapshot *snap;
+
+  while (retired != NULL) {
+    snap = retired;
+    retired = snap->retired_next;
+    snapshot_free(snap);
+  }
+}
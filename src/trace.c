@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2026 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   trace.c
+ * @author agent <agent@local>
+ * @date   19 Oct 2026
+ *
+ * @brief  Operation tracing
+ *
+ * When enabled, timed spans recorded with trace_begin() and trace_end()
+ * are kept in a fixed-size buffer, overwriting the oldest ones.
+ * The buffer can be dumped in the Chrome trace event format, which
+ * chrome://tracing and Perfetto can open.
+ * Spans are only recorded from the main loop.
+ */
+
+#include "project.h"
+
+#include <errno.h>
+#include <fcntl.h>
+
+#define TRACE_BUFFER_SIZE 4096 /**< Number of spans kept */
+#define TRACE_DETAIL_MAX  128
+
+struct trace_span {
+  uint64_t    start;  /**< Microseconds, CLOCK_MONOTONIC */
+  uint64_t    duration;
+  const char *name;   /**< Static string */
+  int         domid;  /**< -1 if not relevant */
+  char        detail[TRACE_DETAIL_MAX];
+};
+
+bool trace_enabled = false;
+
+static struct trace_span spans[TRACE_BUFFER_SIZE];
+static unsigned long     n_spans = 0; /**< Total recorded, the buffer holds the last ones */
+
+/**
+ * @brief Current time for a span, in microseconds
+ */
+uint64_t trace_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Record a span, use trace_end() instead
+ */
+void trace_record(uint64_t start, const char *name, int domid, const char *detail)
+{
+  struct trace_span *span = &spans[n_spans % TRACE_BUFFER_SIZE];
+  size_t len;
+
+  span->start = start;
+  span->duration = trace_now() - start;
+  span->name = name;
+  span->domid = domid;
+  if (detail == NULL)
+    detail = "";
+  len = strnlen(detail, TRACE_DETAIL_MAX);
+  /* Truncate on a character boundary, the dump must stay valid UTF-8 */
+  if (len == TRACE_DETAIL_MAX)
+    len = g_utf8_find_prev_char(detail, detail + TRACE_DETAIL_MAX) - detail;
+  memcpy(span->detail, detail, len);
+  span->detail[len] = '\0';
+  n_spans++;
+}
+
+/**
+ * @brief Turn tracing on or off
+ *
+ * Turning it on clears the buffer.
+ */
+void trace_set_enabled(bool enabled)
+{
+  if (enabled && !trace_enabled)
+    n_spans = 0;
+  trace_enabled = enabled;
+  log(LOG_INFO, "Tracing %s", enabled ? "enabled" : "disabled");
+}
+
+static void json_string(FILE *f, const char *s)
+{
+  fputc('"', f);
+  for (; *s != '\0'; ++s) {
+    if (*s == '"' || *s == '\\')
+      fprintf(f, "\\%c", *s);
+    else if ((unsigned char)*s < 0x20)
+      fprintf(f, "\\u%04x", *s);
+    else
+      fputc(*s, f);
+  }
+  fputc('"', f);
+}
+
+/**
+ * @brief Write the recorded spans as Chrome trace event JSON
+ */
+void trace_dump(FILE *f)
+{
+  struct trace_span *span;
+  unsigned long i, first;
+  int pid = getpid();
+
+  first = (n_spans > TRACE_BUFFER_SIZE) ? n_spans - TRACE_BUFFER_SIZE : 0;
+
+  fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+	  "\"args\":{\"name\":\"cdrom-daemon\"}}", pid);
+  for (i = first; i < n_spans; ++i) {
+    span = &spans[i % TRACE_BUFFER_SIZE];
+    fprintf(f, ",\n{\"name\":");
+    json_string(f, span->name);
+    fprintf(f, ",\"cat\":\"cdrom\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,"
+	    "\"pid\":%d,\"tid\":%d,\"args\":{",
+	    (unsigned long long)span->start, (unsigned long long)span->duration,
+	    pid, pid);
+    if (span->domid >= 0)
+      fprintf(f, "\"domid\":%d%s", span->domid, *span->detail ? "," : "");
+    if (*span->detail) {
+      fprintf(f, "\"detail\":");
+      json_string(f, span->detail);
+    }
+    fprintf(f, "}}");
+  }
+  fprintf(f, "\n]}\n");
+}
+
+/**
+ * @brief Dump the recorded spans to a file
+ *
+ * The file is only readable by root, and a symlink in its place is
+ * refused rather than followed.
+ */
+bool trace_dump_file(const char *path)
+{
+  FILE *f;
+  int fd;
+
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    log(LOG_ERR, "Failed to open %s for the trace dump: %s", path, strerror(errno));
+    return false;
+  }
+  f = fdopen(fd, "w");
+  if (f == NULL) {
+    log(LOG_ERR, "Failed to open %s for the trace dump: %s", path, strerror(errno));
+    close(fd);
+    return false;
+  }
+  trace_dump(f);
+  fclose(f);
+  log(LOG_INFO, "Trace dumped to %s", path);
+
+  return true;
+}
@@ -127,3 +127,32 @@ bool xenstore_mkdir_with_perms(xs_transaction_t trans, int owner, int reader, ch
 
   return xs_set_permissions(xs_handle, trans, path, perms, 2);
 }
+
+/**
+ * @brief Watch the vbd backends of all the guests
+ *
+ * Events are consumed by xenstore_vbds_changed()
+ */
+bool xenstore_watch_vbds(void)
+{
+  return xs_watch(xs_handle, VBD_BACKEND_ROOT, VBD_WATCH_TOKEN);
+}
+
+/**
+ * @brief Consume the pending vbd watch events, without blocking
+ *
+ * @return true if at least one vbd node changed
+ */
+bool xenstore_vbds_changed(void)
+{
+  char **event;
+  bool res = false;
+
+  while ((event = xs_check_watch(xs_handle)) != NULL) {
+    if (!strcmp(event[XS_WATCH_TOKEN], VBD_WATCH_TOKEN))
+      res = true;
+    free(event);
+  }
+
+  return res;
+}